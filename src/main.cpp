@@ -4,6 +4,15 @@
 #include <fstream>
 #include <string>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <set>
+#include <cstring>
+#include <type_traits>
 
 #include <boost/filesystem.hpp>
 
@@ -11,6 +20,7 @@
 
 #include "simple-web-server/client_http.hpp"
 #include "simple-websocket-server/client_ws.hpp"
+#include "simple-websocket-server/server_ws.hpp"
 
 #include "ScreepsApi/ApiManager.hpp"
 #include "ScreepsApi/Web.hpp"
@@ -21,6 +31,7 @@
 #include <curses.h>
 
 ProgramApi::ArgumentParser::Arguments serverOptions;
+std::ostream* logOutput = &std::cout;   // headless traces, moved to stderr when stdout carries query events
 std::shared_ptr < ScreepsApi::Api > client;
 
 std::string toString ( std::istream& stream )
@@ -120,10 +131,21 @@ protected:
     SimpleWeb::Client<SimpleWeb::HTTP> m_web;
 };
 
+/*
+ * connection statistics exposed by WebsocketClient
+ */
+typedef struct {
+    bool connected;
+    unsigned int reconnects;
+    double downtime;        // seconds spent disconnected, current outage included
+} SocketStats;
+
 class WebsocketClient : public ScreepsApi::Web::Socket
 {
 public:
-    WebsocketClient ( std::string host_port_path ) : m_socket ( host_port_path ) {
+    WebsocketClient ( std::string host_port_path ) : m_socket ( host_port_path ),
+        m_socketThreadQuit ( false ), m_socketRunning ( false ), m_connected ( false ), m_everConnected ( false ),
+        m_reconnects ( 0 ), m_downtime ( 0 ), m_backoff ( MinBackoff ) {
         m_socket.on_open = std::bind(&WebsocketClient::on_open,this);
         m_socket.on_message = std::bind(&WebsocketClient::on_message,this,std::placeholders::_1);
         m_socket.on_close = std::bind(&WebsocketClient::on_close,this,std::placeholders::_1,std::placeholders::_2);
@@ -133,17 +155,43 @@ public:
     {
         m_socketThreadQuit = false;
         m_socketThread = std::thread ( &WebsocketClient::thread_loop, this);
+        m_watchdogThread = std::thread ( &WebsocketClient::watchdog_loop, this);
     }
     virtual void close()
     {
-        m_socket.stop ();
+        std::unique_lock<std::mutex> lock ( m_stateMutex );
+        m_socketThreadQuit = true;
+        m_backoffWait.notify_all ();
+        /* a stop () issued just before start () resets the io_service is lost : repeat until start () returns */
+        while ( m_socketRunning )
+        {
+            lock.unlock ();
+            m_socket.stop ();
+            lock.lock ();
+            m_socketStopped.wait_for ( lock, std::chrono::milliseconds ( 50 ), [this] { return ! m_socketRunning; } );
+        }
+        lock.unlock ();
         m_socketThread.join ();
+        m_watchdogThread.join ();
     }
     virtual void send ( std::string message )
     {
-        auto send_stream=std::make_shared<SimpleWeb::SocketClient<SimpleWeb::WS>::SendStream>();
-        *send_stream << message;
-        m_socket.send(send_stream);
+        {
+            /* remember what has to be replayed after a reconnection */
+            std::lock_guard<std::mutex> lock ( m_stateMutex );
+            if ( message.substr ( 0, 5 ) == "auth " ) m_authMessage = message;
+            else if ( message.substr ( 0, 10 ) == "subscribe " ) {
+                if ( std::find ( m_subscriptions.begin (), m_subscriptions.end (), message.substr ( 10 ) ) == m_subscriptions.end () )
+                    m_subscriptions.push_back ( message.substr ( 10 ) );
+            }
+            else if ( message.substr ( 0, 12 ) == "unsubscribe " ) {
+                auto it = std::find ( m_subscriptions.begin (), m_subscriptions.end (), message.substr ( 12 ) );
+                if ( it != m_subscriptions.end () ) m_subscriptions.erase ( it );
+            }
+            /* while the link is down, on_open will replay auth & subscriptions */
+            if ( m_everConnected && ! m_connected ) return;
+        }
+        sendRaw ( message );
     }
     virtual void subscribe ( std::string message, std::function<void(std::string)> callback )
     {
@@ -154,34 +202,148 @@ public:
         if ( m_messageHandlers.find ( message ) != m_messageHandlers.end () )
             m_messageHandlers.erase ( m_messageHandlers.find ( message ) );
     }
+    /* called on the socket thread once a lost connection is back and resubscribed */
+    void onReconnect ( std::function<void()> callback )
+    {
+        m_onReconnect = callback;
+    }
+    SocketStats stats ()
+    {
+        std::lock_guard<std::mutex> lock ( m_stateMutex );
+        SocketStats out;
+        out.connected = m_connected;
+        out.reconnects = m_reconnects;
+        out.downtime = m_downtime;
+        if ( m_everConnected && ! m_connected )
+            out.downtime += std::chrono::duration<double> ( std::chrono::steady_clock::now () - m_disconnectedAt ).count ();
+        return out;
+    }
 protected:
+    static constexpr int MinBackoff = 500;      // ms
+    static constexpr int MaxBackoff = 30000;    // ms
+    static constexpr int IdleTimeout = 30000;   // ms without any message while subscribed
+
     SimpleWeb::SocketClient<SimpleWeb::WS> m_socket;
-    std::thread m_socketThread;
+    std::thread m_socketThread, m_watchdogThread;
     bool m_socketThreadQuit;
+    bool m_socketRunning;               // thread_loop is inside m_socket.start ()
     std::map < std::string, std::function<void(std::string)> > m_messageHandlers;
+    std::function<void()> m_onReconnect;
+
+    std::mutex m_stateMutex;
+    std::condition_variable m_backoffWait, m_socketStopped;
+    std::chrono::steady_clock::time_point m_lastMessage;
+    bool m_connected, m_everConnected;
+    unsigned int m_reconnects;
+    double m_downtime;
+    std::chrono::steady_clock::time_point m_disconnectedAt;
+    int m_backoff;
+    std::string m_authMessage;
+    std::vector < std::string > m_subscriptions;
+
+    void sendRaw ( const std::string& message )
+    {
+        auto send_stream=std::make_shared<SimpleWeb::SocketClient<SimpleWeb::WS>::SendStream>();
+        *send_stream << message;
+        m_socket.send(send_stream);
+    }
     void thread_loop()
     {
-        m_socket.start ();
+        while ( true )
+        {
+            {
+                std::lock_guard<std::mutex> lock ( m_stateMutex );
+                if ( m_socketThreadQuit ) return;
+                m_socketRunning = true;
+                m_lastMessage = std::chrono::steady_clock::now ();
+            }
+            m_socket.start ();
+            /* start () only returns once the connection is gone */
+            std::unique_lock<std::mutex> lock ( m_stateMutex );
+            m_socketRunning = false;
+            m_socketStopped.notify_all ();
+            markDisconnected ();
+            if ( m_socketThreadQuit ) return;
+            m_backoffWait.wait_for ( lock, std::chrono::milliseconds ( m_backoff ), [this] { return m_socketThreadQuit; } );
+            if ( m_socketThreadQuit ) return;
+            m_backoff = std::min ( m_backoff * 2, MaxBackoff );
+        }
+    }
+    /*
+     * a half-open connection never makes start () return : room frames come
+     * every tick, so silence while subscribed means the link is dead
+     */
+    void watchdog_loop()
+    {
+        std::unique_lock<std::mutex> lock ( m_stateMutex );
+        while ( ! m_socketThreadQuit )
+        {
+            m_backoffWait.wait_for ( lock, std::chrono::seconds ( 1 ), [this] { return m_socketThreadQuit; } );
+            if ( m_socketThreadQuit ) return;
+            if ( ! m_socketRunning || ! m_connected || m_subscriptions.empty () ) continue;
+            if ( std::chrono::steady_clock::now () - m_lastMessage < std::chrono::milliseconds ( IdleTimeout ) ) continue;
+            m_lastMessage = std::chrono::steady_clock::now ();
+            markDisconnected ();
+            lock.unlock ();
+            m_socket.stop ();
+            lock.lock ();
+        }
+    }
+    /* m_stateMutex must be held */
+    void markDisconnected ()
+    {
+        if ( ! m_connected ) return;
+        m_connected = false;
+        m_disconnectedAt = std::chrono::steady_clock::now ();
     }
     void on_open()
     {
+        std::string auth;
+        std::vector < std::string > subscriptions;
+        bool reconnected;
+        {
+            std::lock_guard<std::mutex> lock ( m_stateMutex );
+            reconnected = m_everConnected;
+            m_connected = m_everConnected = true;
+            m_backoff = MinBackoff;
+            m_lastMessage = std::chrono::steady_clock::now ();
+            if ( reconnected )
+            {
+                m_reconnects ++;
+                m_downtime += std::chrono::duration<double> ( std::chrono::steady_clock::now () - m_disconnectedAt ).count ();
+            }
+            auth = m_authMessage;
+            subscriptions = m_subscriptions;
+        }
+        /* the first connection is driven by ScreepsApi, later ones are restored here */
+        if ( ! reconnected ) return;
+        if ( auth != "" ) sendRaw ( auth );
+        for ( auto& channel : subscriptions ) sendRaw ( "subscribe " + channel );
+        if ( m_onReconnect ) m_onReconnect ();
     }
     void on_message(std::shared_ptr<SimpleWeb::SocketClient<SimpleWeb::WS>::Message> message)
     {
         std::string key = "";
         auto msg = message->string ();
+        {
+            std::lock_guard<std::mutex> lock ( m_stateMutex );
+            m_lastMessage = std::chrono::steady_clock::now ();
+            /* keep the freshest token for the next reconnection */
+            if ( msg.substr ( 0, 8 ) == "auth ok " ) m_authMessage = "auth " + msg.substr ( 8 );
+        }
         if (msg.substr(0,2) == "[\"" )
         {
             /*
-                ["id",data]
+                ["id",data] : data is cut out of msg in place and moved to the handler
             */
-            std::string tmp = msg.substr ( 2, msg.length () - 3 );
-            size_t pos = tmp.find_first_of ( "\"" );
-            std::string key = tmp.substr ( 0, pos );
-            std::string value = tmp.substr ( pos + 2 );
-            if ( m_messageHandlers.find ( key ) != m_messageHandlers.end () )
+            size_t pos = msg.find_first_of ( "\"", 2 );
+            std::string key = msg.substr ( 2, pos - 2 );
+            auto handler = m_messageHandlers.find ( key );
+            if ( handler != m_messageHandlers.end () )
             {
-                m_messageHandlers[key] ( value );
+                msg.pop_back ();
+                msg.erase ( 0, pos + 2 );
+                handler->second ( std::move ( msg ) );
             }
             return;
         }
@@ -196,12 +358,22 @@ protected:
     }
     void on_close(int, const std::string&)
     {
+        std::lock_guard<std::mutex> lock ( m_stateMutex );
+        markDisconnected ();
     }
     void on_error(const boost::system::error_code&)
     {
+        std::lock_guard<std::mutex> lock ( m_stateMutex );
+        markDisconnected ();
     }
 };
 
+constexpr int WebsocketClient::MinBackoff;
+constexpr int WebsocketClient::MaxBackoff;
+constexpr int WebsocketClient::IdleTimeout;
+
+std::shared_ptr < WebsocketClient > websocket;
+
 /*
  *
  * encapsulation of Web::Client inside a ScreepsApi::Web::Client
@@ -210,7 +382,7 @@ protected:
 
 void error ( std::string message )
 {
-    std::cout << "Error: " << message << std::endl;
+    *logOutput << "Error: " << message << std::endl;
     exit ( -1 );
 }
 
@@ -262,7 +434,7 @@ nlohmann::json gServerOptions = {
             { "long", "room" },
             { "type", "string" },
             { "optional", false },
-            { "help", "room Id to observe : WxNy" },
+            { "help", "room Ids to observe, comma separated : WxNy[,WxNy...]" },
             {"value", {
                 { "required", true }
             } }
@@ -276,6 +448,83 @@ nlohmann::json gServerOptions = {
             {"value", {
                 { "default", false }
             } }
+        } },
+        { "workers", {
+            { "short", "j" },
+            { "long", "workers" },
+            { "type", "int" },
+            { "optional", true },
+            { "help", "threads decoding room frames, 0 for one per core" },
+            { "value", {
+                { "default", "0" },
+                { "required", true }
+            } }
+        } },
+        { "verifyPeriod", {
+            { "short", "v" },
+            { "long", "verify" },
+            { "type", "int" },
+            { "optional", true },
+            { "help", "seconds between checks of the room state against a full fetch, 0 to disable" },
+            { "value", {
+                { "default", "60" },
+                { "required", true }
+            } }
+        } },
+        { "queries", {
+            { "short", "q" },
+            { "long", "query" },
+            { "type", "string" },
+            { "optional", true },
+            { "help", "headless only, ';' separated standing queries such as \"type=tower and energy<200\", objects entering or leaving a result set are printed" },
+            { "value", {
+                { "default", "" },
+                { "required", true }
+            } }
+        } },
+        { "expireTicks", {
+            { "short", "x" },
+            { "long", "expire" },
+            { "type", "int" },
+            { "optional", true },
+            { "help", "ticks after which a moving object no frame mentioned is dropped, 0 to keep it" },
+            { "value", {
+                { "default", "1500" },
+                { "required", true }
+            } }
+        } },
+        { "servePort", {
+            { "short", "l" },
+            { "long", "serve" },
+            { "type", "int" },
+            { "optional", true },
+            { "help", "port of the embedded server sharing observed rooms with local viewers, 0 to disable" },
+            { "value", {
+                { "default", "0" },
+                { "required", true }
+            } }
+        } },
+        { "serveAddress", {
+            { "short", "a" },
+            { "long", "serve-address" },
+            { "type", "string" },
+            { "optional", true },
+            { "help", "address the embedded server binds to, viewers are not authenticated" },
+            { "value", {
+                { "default", "127.0.0.1" },
+                { "required", true }
+            } }
+        } },
+        { "exportFile", {
+            { "short", "e" },
+            { "long", "export" },
+            { "type", "string" },
+            { "optional", true },
+            { "help", "file receiving the columnar export of the room history" },
+            { "value", {
+                { "default", "" },
+                { "required", true }
+            } }
         } }
     };
 
@@ -306,7 +555,7 @@ typedef struct { int energy, energyCapacity; } Storage;
 typedef struct { GameObjectId attack, heal, repair; int energy, energyCapacity; } Tower;
 typedef struct {} Extractor;
 
-typedef struct {bool spawning; } Creep;
+typedef struct {bool spawning; GameTime ageTime; } Creep;
 
 typedef union {
     Controller controller;
@@ -330,192 +579,1417 @@ typedef struct {
     GameObjectData data;
     //
     bool staticObject;
+    unsigned long long hash;        // hashGameObject () of the stored content
+    GameTime lastSeen;              // last tick a frame mentioned the object
 } GameObject;
 
-void ControllerFromJson ( GameObject& go, nlohmann::json data )
+/*
+ * field readers : absent fields are left untouched, a field a diff sets to
+ * null is cleared
+ */
+template < typename T > void FieldFromJson ( const nlohmann::json& data, const char* name, T& out )
+{
+    nlohmann::json::const_iterator it = data.find ( name );
+    if ( it == data.end () ) return;
+    out = it->is_null () ? T () : it->get<T> ();
+}
+
+template < size_t N > void FieldFromJson ( const nlohmann::json& data, const char* name, char ( &out ) [N] )
+{
+    nlohmann::json::const_iterator it = data.find ( name );
+    if ( it == data.end () ) return;
+    snprintf ( out, N, "%s", it->is_null () ? "" : it->get<std::string> ().c_str () );
+}
+
+/* { "_id": ... } reference to another object */
+template < size_t N > void ReferenceFromJson ( const nlohmann::json& data, const char* name, char ( &out ) [N] )
+{
+    nlohmann::json::const_iterator it = data.find ( name );
+    if ( it == data.end () ) return;
+    if ( it->is_null () ) out[0] = 0;
+    else if ( it->is_object () ) FieldFromJson ( *it, "_id", out );
+}
+
+void ControllerFromJson ( GameObject& go, const nlohmann::json& data )
+{
+    FieldFromJson ( data, "level", go.data.controller.level );
+    FieldFromJson ( data, "progress", go.data.controller.progress );
+    FieldFromJson ( data, "downgradeTime", go.data.controller.downgradeTime );
+}
+
+void SourceFromJson ( GameObject& go, const nlohmann::json& data )
+{
+    FieldFromJson ( data, "energy", go.data.source.energy );
+    FieldFromJson ( data, "energyCapacity", go.data.source.energyCapacity );
+    FieldFromJson ( data, "invaderHarvested", go.data.source.invaderHarvested );
+    FieldFromJson ( data, "ticksToRegeneration", go.data.source.ticksToRegeneration );
+    FieldFromJson ( data, "nextRegenerationTime", go.data.source.nextRegenerationTime );
+}
+
+void MineralFromJson ( GameObject& go, const nlohmann::json& data )
+{
+    FieldFromJson ( data, "density", go.data.mineral.density );
+    FieldFromJson ( data, "amount", go.data.mineral.amount );
+    FieldFromJson ( data, "type", go.data.mineral.type );
+}
+
+void SpawnFromJson ( GameObject& go, const nlohmann::json& data )
+{
+    FieldFromJson ( data, "energy", go.data.spawn.energy );
+    FieldFromJson ( data, "energyCapacity", go.data.spawn.energyCapacity );
+    FieldFromJson ( data, "off", go.data.spawn.off );
+    FieldFromJson ( data, "name", go.data.spawn.name );
+    ReferenceFromJson ( data, "spawning", go.data.spawn.spawning );
+}
+
+void ExtensionFromJson ( GameObject& go, const nlohmann::json& data )
+{
+    FieldFromJson ( data, "energy", go.data.spawn.energy );
+    FieldFromJson ( data, "energyCapacity", go.data.spawn.energyCapacity );
+    FieldFromJson ( data, "off", go.data.spawn.off );
+}
+
+void RoadFromJson ( GameObject& go, const nlohmann::json& data )
+{
+    FieldFromJson ( data, "nextDecayTime", go.data.road.nextDecayTime );
+}
+
+void ContainerFromJson ( GameObject& go, const nlohmann::json& data )
+{
+    FieldFromJson ( data, "energy", go.data.container.energy );
+    FieldFromJson ( data, "energyCapacity", go.data.container.energyCapacity );
+}
+
+void StorageFromJson ( GameObject& go, const nlohmann::json& data )
+{
+    FieldFromJson ( data, "energy", go.data.storage.energy );
+    FieldFromJson ( data, "energyCapacity", go.data.storage.energyCapacity );
+}
+
+void TowerFromJson ( GameObject& go, const nlohmann::json& data )
+{
+    FieldFromJson ( data, "energy", go.data.tower.energy );
+    FieldFromJson ( data, "energyCapacity", go.data.tower.energyCapacity );
+    ReferenceFromJson ( data, "attack", go.data.tower.attack );
+    ReferenceFromJson ( data, "heal", go.data.tower.heal );
+    ReferenceFromJson ( data, "repair", go.data.tower.repair );
+}
+
+void CreepFromJson ( GameObject& go, const nlohmann::json& data )
+{
+    go.staticObject = false;
+    FieldFromJson ( data, "spawning", go.data.creep.spawning );
+    FieldFromJson ( data, "ageTime", go.data.creep.ageTime );
+}
+
+void FromJson ( GameObject& go, const nlohmann::json& data )
+{
+    go.staticObject = true;
+    FieldFromJson ( data, "_id", go.id );
+    FieldFromJson ( data, "user", go.user );
+    FieldFromJson ( data, "type", go.type );
+    FieldFromJson ( data, "x", go.x );
+    FieldFromJson ( data, "y", go.y );
+    FieldFromJson ( data, "hitsMax", go.hitsMax );
+    FieldFromJson ( data, "hits", go.hits );
+    if ( go.type == "controller" ) ControllerFromJson ( go, data );
+    if ( go.type == "source" ) SourceFromJson ( go, data );
+    if ( go.type == "mineral" ) MineralFromJson ( go, data );
+    if ( go.type == "spawn" ) SpawnFromJson ( go, data );
+    if ( go.type == "extension" ) ExtensionFromJson ( go, data );
+    if ( go.type == "road" ) RoadFromJson ( go, data );
+    if ( go.type == "container" ) ContainerFromJson ( go, data );
+    if ( go.type == "storage" ) StorageFromJson ( go, data );
+    if ( go.type == "tower" ) TowerFromJson ( go, data );
+    if ( go.type == "creep" ) CreepFromJson ( go, data );
+}
+
+/*
+ * content hash of an object over the fields the observer keeps (FNV-1a)
+ */
+class ObjectHash
+{
+public:
+    ObjectHash () : m_hash ( 14695981039346656037ULL ) {}
+    ObjectHash& operator << ( const std::string& value )
+    {
+        add ( value.data (), value.size () + 1 );
+        return *this;
+    }
+    template < size_t N > ObjectHash& operator << ( const char ( &value ) [N] )
+    {
+        size_t length = strnlen ( value, N );
+        add ( value, length );
+        add ( "", 1 );
+        return *this;
+    }
+    template < typename T > typename std::enable_if < std::is_arithmetic < T >::value, ObjectHash& >::type operator << ( T value )
+    {
+        add ( &value, sizeof ( value ) );
+        return *this;
+    }
+    unsigned long long value () const
+    {
+        return m_hash;
+    }
+protected:
+    unsigned long long m_hash;
+    void add ( const void* data, size_t size )
+    {
+        const unsigned char* bytes = (const unsigned char*) data;
+        for ( size_t i = 0 ; i < size ; i ++ ) m_hash = ( m_hash ^ bytes[i] ) * 1099511628211ULL;
+    }
+};
+
+unsigned long long hashGameObject ( const GameObject& go )
+{
+    ObjectHash h;
+    h << go.id << go.type << go.x << go.y << go.hits << go.hitsMax << go.user << go.staticObject;
+    const GameObjectData& d = go.data;
+    if ( go.type == "controller" ) h << d.controller.level << d.controller.progress << d.controller.downgradeTime;
+    if ( go.type == "source" ) h << d.source.energy << d.source.energyCapacity << d.source.invaderHarvested << d.source.ticksToRegeneration << d.source.nextRegenerationTime;
+    if ( go.type == "mineral" ) h << d.mineral.density << d.mineral.amount << d.mineral.type;
+    if ( go.type == "spawn" ) h << d.spawn.energy << d.spawn.energyCapacity << d.spawn.off << d.spawn.spawning << d.spawn.name;
+    if ( go.type == "extension" ) h << d.extension.energy << d.extension.energyCapacity << d.extension.off;
+    if ( go.type == "road" ) h << d.road.nextDecayTime;
+    if ( go.type == "container" ) h << d.container.energy << d.container.energyCapacity;
+    if ( go.type == "storage" ) h << d.storage.energy << d.storage.energyCapacity;
+    if ( go.type == "tower" ) h << d.tower.attack << d.tower.heal << d.tower.repair << d.tower.energy << d.tower.energyCapacity;
+    if ( go.type == "creep" ) h << d.creep.spawning << d.creep.ageTime;
+    return h.value ();
+}
+
+typedef struct {
+    size_t nodes;       // nodes in use, temporary maps included
+    size_t freed;       // nodes waiting in the free list for reuse
+} PoolStats;
+
+/*
+ * counters shared by every PoolAllocator instantiation : containers rebind
+ * the allocator to their node type. pool state is heap allocated and never
+ * released, global containers still deallocate during static destruction.
+ */
+class PoolCounters
+{
+public:
+    static PoolStats stats ()
+    {
+        std::lock_guard<std::mutex> lock ( mutex () );
+        return counters ();
+    }
+protected:
+    static std::mutex& mutex ()
+    {
+        static std::mutex* m = new std::mutex ();
+        return *m;
+    }
+    static PoolStats& counters ()
+    {
+        static PoolStats* c = new PoolStats ();
+        return *c;
+    }
+};
+
+/*
+ * free-list allocator recycling the nodes of the room content maps ; the
+ * free list is capped so that memory follows the live objects after a peak
+ */
+template < typename T > class PoolAllocator : public PoolCounters
+{
+public:
+    typedef T value_type;
+
+    PoolAllocator () {}
+    template < typename U > PoolAllocator ( const PoolAllocator < U >& ) {}
+
+    T* allocate ( size_t n )
+    {
+        if ( n != 1 ) return static_cast < T* > ( ::operator new ( n * sizeof ( T ) ) );
+        std::lock_guard<std::mutex> lock ( mutex () );
+        counters ().nodes ++;
+        std::vector < T* >& free = freeList ();
+        if ( free.empty () ) return static_cast < T* > ( ::operator new ( sizeof ( T ) ) );
+        T* node = free.back ();
+        free.pop_back ();
+        counters ().freed --;
+        return node;
+    }
+    void deallocate ( T* node, size_t n )
+    {
+        if ( n != 1 ) { ::operator delete ( node ); return; }
+        std::lock_guard<std::mutex> lock ( mutex () );
+        counters ().nodes --;
+        std::vector < T* >& free = freeList ();
+        if ( free.size () >= MaxFree ) { ::operator delete ( node ); return; }
+        free.push_back ( node );
+        counters ().freed ++;
+    }
+    template < typename U > bool operator == ( const PoolAllocator < U >& ) const { return true; }
+    template < typename U > bool operator != ( const PoolAllocator < U >& ) const { return false; }
+protected:
+    static const size_t MaxFree = 4096;
+
+    static std::vector < T* >& freeList ()
+    {
+        static std::vector < T* >* free = new std::vector < T* > ();
+        return *free;
+    }
+};
+
+typedef std::pair < const std::string, GameObject > ObjectEntry;
+typedef std::map < std::string, GameObject, std::less < std::string >, PoolAllocator < ObjectEntry > > ObjectMap;
+
+/*
+ * standing filter over room objects, for instance
+ *   type=creep and user!=me or type=tower and energy<200
+ * "and" binds tighter than "or", "me" stands for the signed in user
+ */
+class ObjectQuery
+{
+public:
+    ObjectQuery ( const std::string& text, const std::string& me ) : m_text ( text )
+    {
+        std::vector < std::string > tokens = tokenize ( text );
+        m_alternatives.push_back ( std::vector < Condition > () );
+        size_t i = 0;
+        while ( i < tokens.size () )
+        {
+            if ( i + 2 >= tokens.size () ) throw Exception ( "invalid query, expected field op value : " + text );
+            Condition condition;
+            condition.field = tokens[i];
+            condition.op = tokens[i+1] == "==" ? "=" : tokens[i+1];
+            condition.text = tokens[i+2] == "me" ? me : tokens[i+2];
+            if ( ! knownField ( condition.field ) ) throw Exception ( "invalid query, unknown field " + condition.field + " : " + text );
+            if ( condition.op != "=" && condition.op != "!=" && condition.op != "<" && condition.op != "<=" && condition.op != ">" && condition.op != ">=" )
+                throw Exception ( "invalid query, unknown operator " + condition.op + " : " + text );
+            char* end = nullptr;
+            condition.number = strtod ( condition.text.c_str (), &end );
+            condition.numeric = end != condition.text.c_str () && *end == 0;
+            if ( ! condition.numeric && condition.op != "=" && condition.op != "!=" )
+                throw Exception ( "invalid query, " + condition.op + " needs a number : " + text );
+            m_alternatives.back ().push_back ( condition );
+            i += 3;
+            if ( i == tokens.size () ) break;
+            if ( tokens[i] == "or" ) m_alternatives.push_back ( std::vector < Condition > () );
+            else if ( tokens[i] != "and" ) throw Exception ( "invalid query, expected and/or : " + text );
+            if ( ++ i == tokens.size () ) throw Exception ( "invalid query, dangling " + tokens[i-1] + " : " + text );
+        }
+        if ( m_alternatives.back ().empty () ) throw Exception ( "invalid query, empty : " + text );
+    }
+    const std::string& text () const
+    {
+        return m_text;
+    }
+    bool matches ( const GameObject& go ) const
+    {
+        for ( auto& alternative : m_alternatives )
+        {
+            bool all = true;
+            for ( auto& condition : alternative ) if ( ! ( all = holds ( condition, go ) ) ) break;
+            if ( all ) return true;
+        }
+        return false;
+    }
+    /* object ids currently in the result set, per room */
+    std::map < std::string, std::set < std::string > > members;
+protected:
+    typedef struct {
+        std::string field, op, text;
+        double number;
+        bool numeric;
+    } Condition;
+
+    std::string m_text;
+    std::vector < std::vector < Condition > > m_alternatives;
+
+    static std::vector < std::string > tokenize ( const std::string& text )
+    {
+        std::vector < std::string > tokens;
+        size_t i = 0;
+        while ( i < text.size () )
+        {
+            if ( isspace ( text[i] ) ) { i ++; continue; }
+            size_t start = i;
+            if ( strchr ( "=!<>", text[i] ) )
+            {
+                i ++;
+                if ( i < text.size () && text[i] == '=' ) i ++;
+            }
+            else while ( i < text.size () && ! isspace ( text[i] ) && ! strchr ( "=!<>", text[i] ) ) i ++;
+            tokens.push_back ( text.substr ( start, i - start ) );
+        }
+        return tokens;
+    }
+    static bool knownField ( const std::string& field )
+    {
+        static const std::set < std::string > fields = {
+            "id", "type", "user", "x", "y", "hits", "hitsMax", "energy", "energyCapacity", "level", "progress", "off", "spawning"
+        };
+        return fields.count ( field ) > 0;
+    }
+    /* false when the field does not apply to the object type */
+    static bool value ( const GameObject& go, const std::string& field, std::string& text, double& number, bool& numeric )
+    {
+        const GameObjectData& d = go.data;
+        numeric = true;
+        if ( field == "id" ) { text = go.id; numeric = false; }
+        else if ( field == "type" ) { text = go.type; numeric = false; }
+        else if ( field == "user" ) { text = go.user; numeric = false; }
+        else if ( field == "x" ) number = go.x;
+        else if ( field == "y" ) number = go.y;
+        else if ( field == "hits" ) number = go.hits;
+        else if ( field == "hitsMax" ) number = go.hitsMax;
+        else if ( field == "energy" || field == "energyCapacity" )
+        {
+            bool capacity = field == "energyCapacity";
+            if ( go.type == "source" ) number = capacity ? d.source.energyCapacity : d.source.energy;
+            else if ( go.type == "spawn" ) number = capacity ? d.spawn.energyCapacity : d.spawn.energy;
+            else if ( go.type == "extension" ) number = capacity ? d.extension.energyCapacity : d.extension.energy;
+            else if ( go.type == "container" ) number = capacity ? d.container.energyCapacity : d.container.energy;
+            else if ( go.type == "storage" ) number = capacity ? d.storage.energyCapacity : d.storage.energy;
+            else if ( go.type == "tower" ) number = capacity ? d.tower.energyCapacity : d.tower.energy;
+            else return false;
+        }
+        else if ( field == "level" && go.type == "controller" ) number = d.controller.level;
+        else if ( field == "progress" && go.type == "controller" ) number = d.controller.progress;
+        else if ( field == "off" && go.type == "spawn" ) number = d.spawn.off;
+        else if ( field == "off" && go.type == "extension" ) number = d.extension.off;
+        else if ( field == "spawning" && go.type == "creep" ) number = d.creep.spawning;
+        else return false;
+        return true;
+    }
+    static bool holds ( const Condition& condition, const GameObject& go )
+    {
+        std::string text;
+        double number = 0;
+        bool numeric;
+        if ( ! value ( go, condition.field, text, number, numeric ) ) return false;
+        if ( ! numeric )
+        {
+            if ( condition.op == "=" ) return text == condition.text;
+            if ( condition.op == "!=" ) return text != condition.text;
+            return false;
+        }
+        if ( ! condition.numeric ) return condition.op == "!=";
+        if ( condition.op == "=" ) return number == condition.number;
+        if ( condition.op == "!=" ) return number != condition.number;
+        if ( condition.op == "<" ) return number < condition.number;
+        if ( condition.op == "<=" ) return number <= condition.number;
+        if ( condition.op == ">" ) return number > condition.number;
+        return number >= condition.number;
+    }
+};
+
+std::vector < ObjectQuery > queries;
+
+typedef struct {
+    ObjectMap content;
+    nlohmann::json initialData;         // Room () reply, holds the terrain
+    std::atomic<bool> initialized;
+    unsigned long long hash;            // order independent : sum of the object hashes
+    bool tracking;                      // a verification is running, record touched objects
+    std::set < std::string > touched;
+    std::set < std::string > changed;   // objects stored or erased since the queries last ran
+    GameTime gameTime;                  // tick of the last applied frame
+    GameTime nextExpiry;                // tick of the next expiry sweep
+} RoomState;
+
+std::vector < std::string > observedRooms;
+std::map < std::string, RoomState > rooms;  // one entry per observed room, filled before listening
+
+nlohmann::json userData;
+nlohmann::json updatedRoomData;
+std::atomic<bool> updatePaused ( false );
+
+void drawWindow ();
+
+std::map < std::string, bool > displayed;
+
+std::atomic<long long> liveObjects ( 0 );   // objects held by the rooms, temporary maps excluded
+
+/* store an object in its room, keeping the room hash up to date */
+void storeObject ( RoomState& room, GameObject& go )
+{
+    go.hash = hashGameObject ( go );
+    go.lastSeen = room.gameTime;
+    ObjectMap::iterator known = room.content.find ( go.id );
+    if ( known != room.content.end () )
+    {
+        room.hash -= known->second.hash;
+        known->second = go;
+    }
+    else
+    {
+        room.content[go.id] = go;
+        liveObjects ++;
+    }
+    room.hash += go.hash;
+    if ( room.tracking ) room.touched.insert ( go.id );
+    if ( ! queries.empty () ) room.changed.insert ( go.id );
+}
+
+void eraseObject ( RoomState& room, ObjectMap::iterator known )
+{
+    room.hash -= known->second.hash;
+    if ( room.tracking ) room.touched.insert ( known->first );
+    if ( ! queries.empty () ) room.changed.insert ( known->first );
+    room.content.erase ( known );
+    liveObjects --;
+}
+
+std::atomic<unsigned long long> objectsRemoved ( 0 ), objectsExpired ( 0 );
+GameTime expireTicks = 0;               // unseen moving objects are dropped after, 0 to keep them
+
+/*
+ * end of life of the objects no deletion diff will report : creeps past
+ * their ageTime and moving objects unseen for expireTicks. swept every
+ * ExpirySweep ticks so the cost is spread over the frames.
+ */
+const GameTime ExpirySweep = 100;
+
+void expireRoomContent ( RoomState& room )
+{
+    if ( room.gameTime == 0 || room.gameTime < room.nextExpiry ) return;
+    room.nextExpiry = room.gameTime + ExpirySweep;
+    for ( ObjectMap::iterator it = room.content.begin () ; it != room.content.end () ; )
+    {
+        const GameObject& go = it->second;
+        bool dead = go.type == "creep" && go.data.creep.ageTime > 0 && room.gameTime >= go.data.creep.ageTime;
+        bool lost = ! go.staticObject && expireTicks > 0 && room.gameTime > go.lastSeen + expireTicks;
+        if ( dead || lost )
+        {
+            eraseObject ( room, it ++ );
+            objectsExpired ++;
+        }
+        else ++ it;
+    }
+}
+
+/*
+ * bring the query result sets up to date with the objects changed in a room,
+ * printing one json line per object entering or leaving a result set
+ */
+void refreshQueries ( const std::string& name, RoomState& room, const nlohmann::json& gameTime )
+{
+    for ( auto& query : queries )
+    {
+        std::set < std::string >& members = query.members[name];
+        for ( auto& id : room.changed )
+        {
+            ObjectMap::const_iterator object = room.content.find ( id );
+            bool now = object != room.content.end () && query.matches ( object->second );
+            bool was = members.count ( id ) > 0;
+            if ( now == was ) continue;
+            nlohmann::json event = { { "query", query.text () }, { "room", name }, { "event", now ? "enter" : "leave" }, { "id", id } };
+            if ( ! gameTime.is_null () ) event["gameTime"] = gameTime;
+            if ( now )
+            {
+                event["type"] = object->second.type;
+                event["x"] = object->second.x;
+                event["y"] = object->second.y;
+                members.insert ( id );
+            }
+            else members.erase ( id );
+            std::cout << event.dump () << std::endl;
+        }
+    }
+    room.changed.clear ();
+}
+
+void initializeRoomContent (RoomState& room, const nlohmann::json& roomData)
 {
-    if ( data.find ( "level") != data.end () ) go.data.controller.level = data["level"].get<int> ();
-    if ( data.find ( "progress") != data.end () ) go.data.controller.progress = data["progress"].get<int> ();
-    if ( data.find ( "downgradeTime") != data.end () ) go.data.controller.downgradeTime = data["downgradeTime"].get<int> ();
+    if ( roomData.is_null () ) throw Exception ( "null data received" );
+    *logOutput << roomData.dump ( 4 ) << std::endl;
+    nlohmann::json::const_iterator objects = roomData.find ( "objects" );
+    if ( objects != roomData.end () ) for ( nlohmann::json::const_iterator it = objects->begin () ; it != objects->end () ; ++ it )
+    {
+        if ( it.value ().is_null () ) continue;
+        GameObject go = GameObject ();
+        try {
+            FromJson ( go, it.value () );
+        }
+        catch (...) { throw Exception ( "problem in room initial content" ); }
+        storeObject ( room, go );
+        /**/
+        if ( serverOptions["disableGUI"].get<bool> () ) if ( displayed.find ( go.type ) == displayed.end () )
+        {
+            *logOutput << "---------" << go.type << "---------" << std::endl << it.value().dump () << std::endl;
+            displayed[go.type] = true;
+        }
+        /**/
+    }
+    room.initialized = true;
 }
 
-void SourceFromJson ( GameObject& go, nlohmann::json data )
+/*
+ * first frame after a reconnection carries every object of the room :
+ * rebuild the object list from it, terrain & other caches are kept
+ */
+void resyncRoomContent (RoomState& room, const nlohmann::json& roomData)
 {
-    if ( data.find ( "energy") != data.end () ) go.data.source.energy = data["energy"].get<int> ();
-    if ( data.find ( "energyCapacity") != data.end () ) go.data.source.energyCapacity = data["energyCapacity"].get<int> ();
-    if ( data.find ( "invaderHarvested") != data.end () ) go.data.source.invaderHarvested = data["invaderHarvested"].get<int> ();
-    if ( data.find ( "ticksToRegeneration") != data.end () ) go.data.source.ticksToRegeneration = data["ticksToRegeneration"].get<int> ();
-    if ( data.find ( "nextRegenerationTime") != data.end () ) go.data.source.nextRegenerationTime = data["nextRegenerationTime"].get<int> ();
+    ObjectMap& roomContent = room.content;
+    ObjectMap content;
+    unsigned long long hash = 0;
+    nlohmann::json::const_iterator objects = roomData.find ( "objects" );
+    if ( objects != roomData.end () ) for ( nlohmann::json::const_iterator it = objects->begin () ; it != objects->end () ; ++ it )
+    {
+        if ( it.value ().is_null () ) continue;
+        GameObject go = GameObject ();
+        ObjectMap::iterator known = roomContent.find ( it.key () );
+        if ( known != roomContent.end () ) go = known->second;
+        try {
+            FromJson ( go, it.value () );
+        }
+        catch (...) { throw Exception ( "problem in room resync content" ); }
+        if ( go.id == "" ) go.id = it.key ();
+        go.hash = hashGameObject ( go );
+        go.lastSeen = room.gameTime;
+        hash += go.hash;
+        content[go.id] = go;
+        if ( room.tracking ) room.touched.insert ( go.id );
+    }
+    if ( room.tracking ) for ( auto& known : roomContent ) room.touched.insert ( known.first );
+    if ( ! queries.empty () )
+    {
+        for ( auto& known : roomContent ) room.changed.insert ( known.first );
+        for ( auto& known : content ) room.changed.insert ( known.first );
+    }
+    liveObjects += (long long) content.size () - (long long) roomContent.size ();
+    roomContent.swap ( content );
+    room.hash = hash;
 }
 
-void MineralFromJson ( GameObject& go, nlohmann::json data )
-{
-    if ( data.find ( "density") != data.end () ) go.data.mineral.density = data["density"].get<int> ();
-    if ( data.find ( "amount") != data.end () ) go.data.mineral.amount = data["amount"].get<float> ();
-    if ( data.find ( "type") != data.end () ) sprintf ( go.data.mineral.type, "%s", data["type"].get<std::string> ().c_str () );
-}
+bool firstUpdate = true;
+
+void updateRoomContent (RoomState& room, const nlohmann::json& roomData)
+{
+    ObjectMap& roomContent = room.content;
+    nlohmann::json::const_iterator objects = roomData.find ( "objects" );
+    //if ( firstUpdate )
+    if ( objects != roomData.end () ) for ( nlohmann::json::const_iterator it = objects->begin () ; it != objects->end () ; ++ it )
+    {
+        std::string id = it.key (); // sprintf ( id, "%s", it.key ().c_str () );
+        ObjectMap::iterator known = roomContent.find ( id );
+        if ( it.value ().is_null () )
+        {
+            /* deletion diff */
+            if ( known != roomContent.end () )
+            {
+                eraseObject ( room, known );
+                objectsRemoved ++;
+            }
+            continue;
+        }
+        GameObject go = GameObject ();
+        if ( known != roomContent.end () ) go = known->second;
+        go.id = id;
+        try {
+            /* diffs only carry the changed fields, every one of them is applied */
+            FromJson ( go, it.value () );
+        }
+        catch ( std::exception& e )
+        {
+            /* one malformed object must not hold back the rest of the frame */
+            std::cerr << "Error: problem in room updated content, object " << id << ": " << e.what () << std::endl;
+            continue;
+        }
+        storeObject ( room, go );
+        /**/
+        if ( serverOptions["disableGUI"].get<bool> () ) if ( displayed.find ( go.type ) == displayed.end () )
+        {
+            *logOutput << "---------" << go.type << "---------" << std::endl << it.value().dump () << std::endl;
+            displayed[go.type] = true;
+        }
+        /**/
+    }
+}
+
+/*
+ * merge a later room frame into a pending one : objects and their fields
+ * are merged recursively, a later value (null included) always wins
+ */
+void mergeRoomFrame ( nlohmann::json& into, const nlohmann::json& later )
+{
+    if ( ! into.is_object () || ! later.is_object () )
+    {
+        into = later;
+        return;
+    }
+    for ( nlohmann::json::const_iterator it = later.begin () ; it != later.end () ; ++ it )
+    {
+        nlohmann::json::iterator known = into.find ( it.key () );
+        if ( known != into.end () && known->is_object () && it.value ().is_object () )
+            mergeRoomFrame ( *known, it.value () );
+        else
+            into[it.key ()] = it.value ();
+    }
+}
+
+typedef struct {
+    std::string room;
+    bool full;              // carries every object of the room
+    nlohmann::json data;
+} RoomFrame;
+
+typedef struct {
+    unsigned long long received, applied, merged, dropped;
+    size_t depth, maxDepth;
+} FrameQueueStats;
+
+/*
+ * bounded queue between the socket thread and the thread applying frames
+ *
+ * a room has at most one pending frame : while the consumer lags, new diffs
+ * are merged into it and a new full frame replaces it, so the applied state
+ * is never more than one frame behind. pushing a frame for another room
+ * blocks when the queue is full.
+ */
+class FrameQueue
+{
+public:
+    FrameQueue ( size_t capacity ) : m_capacity ( capacity ), m_stopped ( false )
+    {
+        m_stats = FrameQueueStats ();
+    }
+    void push ( RoomFrame frame )
+    {
+        std::unique_lock<std::mutex> lock ( m_mutex );
+        m_stats.received ++;
+        for ( std::deque < RoomFrame >::reverse_iterator it = m_frames.rbegin () ; it != m_frames.rend () ; ++ it )
+        {
+            if ( it->room != frame.room ) continue;
+            if ( frame.full )
+            {
+                it->data = std::move ( frame.data );
+                it->full = true;
+                m_stats.dropped ++;
+            }
+            else
+            {
+                mergeRoomFrame ( it->data, frame.data );
+                m_stats.merged ++;
+            }
+            return;
+        }
+        m_notFull.wait ( lock, [this] { return m_stopped || m_frames.size () < m_capacity; } );
+        if ( m_stopped ) return;
+        m_frames.push_back ( std::move ( frame ) );
+        m_stats.maxDepth = std::max ( m_stats.maxDepth, m_frames.size () );
+        m_notEmpty.notify_one ();
+    }
+    /* blocks until a frame is available, false once the queue is stopped */
+    bool pop ( RoomFrame& frame )
+    {
+        std::unique_lock<std::mutex> lock ( m_mutex );
+        m_notEmpty.wait ( lock, [this] { return m_stopped || ! m_frames.empty (); } );
+        if ( m_frames.empty () ) return false;
+        frame = std::move ( m_frames.front () );
+        m_frames.pop_front ();
+        m_stats.applied ++;
+        m_notFull.notify_one ();
+        return true;
+    }
+    void stop ()
+    {
+        std::lock_guard<std::mutex> lock ( m_mutex );
+        m_stopped = true;
+        m_notEmpty.notify_all ();
+        m_notFull.notify_all ();
+    }
+    FrameQueueStats stats ()
+    {
+        std::lock_guard<std::mutex> lock ( m_mutex );
+        FrameQueueStats out = m_stats;
+        out.depth = m_frames.size ();
+        return out;
+    }
+protected:
+    size_t m_capacity;
+    bool m_stopped;
+    std::deque < RoomFrame > m_frames;
+    std::mutex m_mutex;
+    std::condition_variable m_notEmpty, m_notFull;
+    FrameQueueStats m_stats;
+};
+
+FrameQueue frameQueue ( 64 );
+std::mutex roomMutex;               // guards room contents between apply & render
+std::atomic<bool> roomDirty ( false );
 
-void SpawnFromJson ( GameObject& go, nlohmann::json data )
+/*
+ * embedded websocket server sharing the observed rooms with local viewers
+ *
+ * speaks the screeps socket dialect : a viewer sends "subscribe room:W1N1"
+ * and receives ["room:W1N1",{...}] frames, the first one being a full
+ * snapshot of the room, the following ones the per-tick diffs. every frame
+ * is serialised once whatever the number of subscribers.
+ */
+class FanoutServer
 {
-    if ( data.find ( "energy") != data.end () ) go.data.spawn.energy = data["energy"].get<int> ();
-    if ( data.find ( "energyCapacity") != data.end () ) go.data.spawn.energyCapacity = data["energyCapacity"].get<int> ();
-    if ( data.find ( "off") != data.end () ) go.data.spawn.off = data["off"].get<bool> ();
-    if ( data.find ( "name") != data.end () ) sprintf ( go.data.spawn.name, "%s", data["name"].get<std::string> ().c_str () );
-    if ( data.find ( "spawning") != data.end () ) {
-        if ( ! data["spawning"].is_null () ) 
-            if ( data["spawning"].find ( "_id") != data["spawning"].end () )
-                sprintf ( go.data.spawn.spawning, "%s", data["spawning"]["_id"].get<std::string> ().c_str () );
-    }
-}
+public:
+    typedef SimpleWeb::SocketServer<SimpleWeb::WS> Server;
+    typedef std::shared_ptr<Server::Connection> Connection;
 
-void ExtensionFromJson ( GameObject& go, nlohmann::json data )
-{
-    if ( data.find ( "energy") != data.end () ) go.data.spawn.energy = data["energy"].get<int> ();
-    if ( data.find ( "energyCapacity") != data.end () ) go.data.spawn.energyCapacity = data["energyCapacity"].get<int> ();
-    if ( data.find ( "off") != data.end () ) go.data.spawn.off = data["off"].get<bool> ();
-}
+    FanoutServer ( unsigned short port, const std::string& address )
+    {
+        m_server.config.port = port;
+        m_server.config.address = address;
+        auto& endpoint = m_server.endpoint["^/socket/websocket/?$"];
+        endpoint.on_message = std::bind ( &FanoutServer::on_message, this, std::placeholders::_1, std::placeholders::_2 );
+        endpoint.on_close = std::bind ( &FanoutServer::on_close, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3 );
+        endpoint.on_error = std::bind ( &FanoutServer::on_error, this, std::placeholders::_1, std::placeholders::_2 );
+    }
+    ~FanoutServer ()
+    {
+        stop ();
+    }
+    void start ()
+    {
+        m_serverThread = std::thread ( [this] () {
+            try {
+                m_server.start ();
+            }
+            catch ( std::exception& e )
+            {
+                /* the rooms are still observed, only the viewers are left out */
+                std::cerr << "Error: cannot serve on " << m_server.config.address << ":" << m_server.config.port << ": " << e.what () << std::endl;
+            }
+        } );
+    }
+    void stop ()
+    {
+        if ( ! m_serverThread.joinable () ) return;
+        m_server.stop ();
+        m_serverThread.join ();
+    }
+    void observe ( const std::string& room )
+    {
+        std::lock_guard<std::mutex> lock ( m_mutex );
+        m_channels["room:" + room];
+    }
+    /* apply thread : record the frame into the room snapshot and forward it to the subscribers */
+    void publish ( const std::string& room, const nlohmann::json& frame, bool full )
+    {
+        std::lock_guard<std::mutex> lock ( m_mutex );
+        Channel& channel = m_channels["room:" + room];
+        if ( full ) channel.snapshot = frame;
+        else
+        {
+            mergeRoomFrame ( channel.snapshot, frame );
+            nlohmann::json& objects = channel.snapshot["objects"];
+            for ( nlohmann::json::iterator it = objects.begin () ; it != objects.end () ; )
+                if ( it.value ().is_null () ) it = objects.erase ( it );
+                else ++ it;
+        }
+        channel.ready = true;
+        channel.snapshotPayload.clear ();
+        if ( channel.subscribers.empty () ) return;
+        std::string payload = message ( "room:" + room, frame );
+        for ( auto& connection : channel.subscribers ) send ( connection, payload );
+    }
+    size_t subscribers ()
+    {
+        std::lock_guard<std::mutex> lock ( m_mutex );
+        size_t count = 0;
+        for ( auto& channel : m_channels ) count += channel.second.subscribers.size ();
+        return count;
+    }
+protected:
+    typedef struct {
+        bool ready = false;
+        nlohmann::json snapshot;
+        std::string snapshotPayload;    // serialised snapshot, shared by viewers joining on the same tick
+        std::set < Connection > subscribers;
+    } Channel;
+
+    Server m_server;
+    std::thread m_serverThread;
+    std::mutex m_mutex;
+    std::map < std::string, Channel > m_channels;
+
+    static std::string message ( const std::string& channel, const nlohmann::json& data )
+    {
+        return "[\"" + channel + "\"," + data.dump () + "]";
+    }
+    void send ( const Connection& connection, const std::string& payload )
+    {
+        auto send_stream = std::make_shared<Server::SendStream> ();
+        send_stream->write ( payload.data (), payload.size () );
+        m_server.send ( connection, send_stream );
+    }
+    void on_message ( Connection connection, std::shared_ptr<Server::Message> message )
+    {
+        std::string msg = message->string ();
+        std::lock_guard<std::mutex> lock ( m_mutex );
+        if ( msg.substr ( 0, 10 ) == "subscribe " )
+        {
+            /* only rooms observed by this process can be subscribed */
+            std::map < std::string, Channel >::iterator channel = m_channels.find ( msg.substr ( 10 ) );
+            if ( channel == m_channels.end () ) return;
+            channel->second.subscribers.insert ( connection );
+            if ( ! channel->second.ready ) return;
+            if ( channel->second.snapshotPayload.empty () )
+                channel->second.snapshotPayload = FanoutServer::message ( channel->first, channel->second.snapshot );
+            send ( connection, channel->second.snapshotPayload );
+        }
+        else if ( msg.substr ( 0, 12 ) == "unsubscribe " )
+        {
+            std::map < std::string, Channel >::iterator channel = m_channels.find ( msg.substr ( 12 ) );
+            if ( channel != m_channels.end () ) channel->second.subscribers.erase ( connection );
+        }
+    }
+    void forget ( Connection connection )
+    {
+        std::lock_guard<std::mutex> lock ( m_mutex );
+        for ( auto& channel : m_channels ) channel.second.subscribers.erase ( connection );
+    }
+    void on_close ( Connection connection, int, const std::string& )
+    {
+        forget ( connection );
+    }
+    void on_error ( Connection connection, const boost::system::error_code& )
+    {
+        forget ( connection );
+    }
+};
 
-void RoadFromJson ( GameObject& go, nlohmann::json data )
-{
-    if ( data.find ( "nextDecayTime") != data.end () ) go.data.road.nextDecayTime = data["nextDecayTime"].get<int> ();
-}
+std::shared_ptr < FanoutServer > fanout;
 
-void ContainerFromJson ( GameObject& go, nlohmann::json data )
+/*
+ * columnar export of the room history, see "Columnar export format" in README.md
+ *
+ * every applied frame is turned into (tick, object, field, value) rows kept
+ * in one column group per field ; ids, types, users, rooms, field names and
+ * string values go to a dictionary, numbers are delta encoded per column.
+ * a chunk is appended to the file every chunkTicks ticks.
+ */
+class ColumnarExporter
 {
-    if ( data.find ( "energy") != data.end () ) go.data.container.energy = data["energy"].get<int> ();
-    if ( data.find ( "energyCapacity") != data.end () ) go.data.container.energyCapacity = data["energyCapacity"].get<int> ();
-}
+public:
+    ColumnarExporter ( const std::string& path, GameTime chunkTicks ) :
+        m_out ( path.c_str (), std::ios::binary | std::ios::trunc ), m_chunkTicks ( chunkTicks ),
+        m_firstTick ( 0 ), m_lastTick ( 0 ), m_rows ( 0 ), m_newStrings ( 0 ), m_newObjects ( 0 )
+    {
+        if ( ! m_out ) throw Exception ( "cannot open export file " + path );
+        m_out.write ( "SRCX\x01", 5 );
+    }
+    ~ColumnarExporter ()
+    {
+        flush ();
+    }
+    void record ( const std::string& room, const nlohmann::json& frame )
+    {
+        std::lock_guard<std::mutex> lock ( m_mutex );
+        GameTime tick = m_lastTick;       // frames without gameTime belong to the last tick seen
+        if ( frame.find ( "gameTime" ) != frame.end () && frame["gameTime"].is_number () ) tick = frame["gameTime"].get<GameTime> ();
+        if ( m_rows > 0 && ( tick < m_lastTick || tick >= m_firstTick + m_chunkTicks ) ) writeChunk ();
+        if ( m_rows == 0 ) m_firstTick = tick;
+        m_lastTick = tick;
+        nlohmann::json::const_iterator objects = frame.find ( "objects" );
+        if ( objects == frame.end () || ! objects->is_object () ) return;
+        for ( nlohmann::json::const_iterator it = objects->begin () ; it != objects->end () ; ++ it )
+        {
+            size_t object = objectIndex ( room, it.key (), it.value () );
+            if ( it.value ().is_null () ) addRow ( tick, object, "$removed", Integer, 1 );
+            else addObject ( tick, object, "", it.value () );
+        }
+    }
+    void flush ()
+    {
+        std::lock_guard<std::mutex> lock ( m_mutex );
+        if ( m_rows > 0 || m_newStrings > 0 || m_newObjects > 0 ) writeChunk ();
+        m_out.flush ();
+    }
+protected:
+    enum Kind { Integer = 0, String = 1, Real = 2 };
+    typedef struct {
+        size_t rows;
+        GameTime lastTick;
+        long long lastObject, lastValue;
+        std::string ticks, objects, values;
+    } Column;
+
+    std::mutex m_mutex;
+    std::ofstream m_out;
+    GameTime m_chunkTicks, m_firstTick, m_lastTick;
+    size_t m_rows;
+    std::map < std::string, size_t > m_strings;
+    std::string m_stringSection;
+    size_t m_newStrings;
+    std::map < std::pair < std::string, std::string >, size_t > m_objects;     // ( room, id )
+    std::string m_objectSection;
+    size_t m_newObjects;
+    std::map < std::pair < size_t, int >, Column > m_columns;   // ( field name, kind )
+
+    static void putVarint ( std::string& out, unsigned long long value )
+    {
+        while ( value >= 0x80 )
+        {
+            out += (char) ( ( value & 0x7F ) | 0x80 );
+            value >>= 7;
+        }
+        out += (char) value;
+    }
+    static void putSigned ( std::string& out, long long value )
+    {
+        putVarint ( out, ( (unsigned long long) value << 1 ) ^ (unsigned long long) ( value >> 63 ) );
+    }
+    size_t stringIndex ( const std::string& str )
+    {
+        std::map < std::string, size_t >::iterator known = m_strings.find ( str );
+        if ( known != m_strings.end () ) return known->second;
+        size_t index = m_strings.size ();
+        m_strings[str] = index;
+        putVarint ( m_stringSection, str.size () );
+        m_stringSection += str;
+        m_newStrings ++;
+        return index;
+    }
+    size_t objectIndex ( const std::string& room, const std::string& id, const nlohmann::json& data )
+    {
+        /* an object crossing into another observed room gets a new entry there */
+        std::pair < std::string, std::string > key ( room, id );
+        std::map < std::pair < std::string, std::string >, size_t >::iterator known = m_objects.find ( key );
+        if ( known != m_objects.end () ) return known->second;
+        size_t index = m_objects.size ();
+        m_objects[key] = index;
+        /* type & user are only known when the object shows up whole, 0 stands for unknown */
+        size_t type = 0, user = 0;
+        if ( data.is_object () && data.find ( "type" ) != data.end () && data["type"].is_string () ) type = stringIndex ( data["type"].get<std::string> () ) + 1;
+        if ( data.is_object () && data.find ( "user" ) != data.end () && data["user"].is_string () ) user = stringIndex ( data["user"].get<std::string> () ) + 1;
+        putVarint ( m_objectSection, stringIndex ( id ) );
+        putVarint ( m_objectSection, stringIndex ( room ) );
+        putVarint ( m_objectSection, type );
+        putVarint ( m_objectSection, user );
+        m_newObjects ++;
+        return index;
+    }
+    void addObject ( GameTime tick, size_t object, const std::string& prefix, const nlohmann::json& data )
+    {
+        for ( nlohmann::json::const_iterator it = data.begin () ; it != data.end () ; ++ it )
+        {
+            std::string field = data.is_array () ? prefix + std::to_string ( it - data.begin () ) : prefix + it.key ();
+            if ( prefix == "" && ( field == "_id" || field == "type" || field == "user" || field == "room" ) ) continue;
+            const nlohmann::json& value = it.value ();
+            if ( value.is_object () || value.is_array () ) addObject ( tick, object, field + ".", value );
+            else if ( value.is_boolean () ) addRow ( tick, object, field, Integer, value.get<bool> () ? 1 : 0 );
+            else if ( value.is_number_integer () ) addRow ( tick, object, field, Integer, value.get<long long> () );
+            else if ( value.is_string () ) addRow ( tick, object, field, String, stringIndex ( value.get<std::string> () ) );
+            else if ( value.is_number_float () )
+            {
+                double real = value.get<double> ();
+                long long bits;
+                memcpy ( &bits, &real, sizeof ( bits ) );
+                addRow ( tick, object, field, Real, bits );
+            }
+        }
+    }
+    void addRow ( GameTime tick, size_t object, const std::string& field, Kind kind, long long value )
+    {
+        std::pair < size_t, int > key ( stringIndex ( field ), kind );
+        std::map < std::pair < size_t, int >, Column >::iterator found = m_columns.find ( key );
+        if ( found == m_columns.end () )
+        {
+            Column fresh = Column ();
+            fresh.lastTick = m_firstTick;
+            found = m_columns.insert ( std::make_pair ( key, fresh ) ).first;
+        }
+        Column& column = found->second;
+        putVarint ( column.ticks, tick - column.lastTick );
+        putSigned ( column.objects, (long long) object - column.lastObject );
+        if ( kind == Real )
+            for ( int i = 0 ; i < 8 ; i ++ ) column.values += (char) ( ( (unsigned long long) value >> ( 8 * i ) ) & 0xFF );
+        else
+            putSigned ( column.values, value - column.lastValue );
+        column.lastTick = tick;
+        column.lastObject = object;
+        column.lastValue = value;
+        column.rows ++;
+        m_rows ++;
+    }
+    void writeChunk ()
+    {
+        std::string chunk = "CHNK";
+        putVarint ( chunk, m_firstTick );
+        putVarint ( chunk, m_lastTick - m_firstTick );
+        putVarint ( chunk, m_newStrings );
+        putVarint ( chunk, m_stringSection.size () );
+        chunk += m_stringSection;
+        putVarint ( chunk, m_newObjects );
+        putVarint ( chunk, m_objectSection.size () );
+        chunk += m_objectSection;
+        putVarint ( chunk, m_columns.size () );
+        for ( auto& column : m_columns )
+        {
+            putVarint ( chunk, column.first.first );
+            chunk += (char) column.first.second;
+            putVarint ( chunk, column.second.rows );
+            putVarint ( chunk, column.second.ticks.size () );
+            putVarint ( chunk, column.second.objects.size () );
+            putVarint ( chunk, column.second.values.size () );
+        }
+        for ( auto& column : m_columns )
+            chunk += column.second.ticks + column.second.objects + column.second.values;
+        m_out.write ( chunk.data (), chunk.size () );
+        m_stringSection.clear ();
+        m_objectSection.clear ();
+        m_columns.clear ();
+        m_rows = m_newStrings = m_newObjects = 0;
+    }
+};
 
-void StorageFromJson ( GameObject& go, nlohmann::json data )
-{
-    if ( data.find ( "energy") != data.end () ) go.data.storage.energy = data["energy"].get<int> ();
-    if ( data.find ( "energyCapacity") != data.end () ) go.data.storage.energyCapacity = data["energyCapacity"].get<int> ();
-}
+std::shared_ptr < ColumnarExporter > exporter;
 
-void TowerFromJson ( GameObject& go, nlohmann::json data )
+/*
+ * work-stealing pool decoding frames away from the socket thread
+ *
+ * tasks are dealt round-robin to the workers' deques ; a worker takes from
+ * the front of its own deque and steals from the back of the others when
+ * it runs dry.
+ */
+class WorkerPool
 {
-    if ( data.find ( "energy") != data.end () ) go.data.tower.energy = data["energy"].get<int> ();
-    if ( data.find ( "energyCapacity") != data.end () ) go.data.tower.energyCapacity = data["energyCapacity"].get<int> ();
-    if ( data.find ( "attack") != data.end () ) {
-        if ( ! data["attack"].is_null () ) 
-            if ( data["attack"].find ( "_id") != data["attack"].end () )
-                sprintf ( go.data.tower.attack, "%s", data["attack"]["_id"].get<std::string> ().c_str () );
+public:
+    WorkerPool ( size_t workers ) : m_pending ( 0 ), m_stopped ( false ), m_next ( 0 )
+    {
+        if ( workers == 0 ) workers = 1;
+        for ( size_t i = 0 ; i < workers ; i ++ ) m_workers.push_back ( std::unique_ptr < Worker > ( new Worker () ) );
+        for ( size_t i = 0 ; i < workers ; i ++ ) m_threads.push_back ( std::thread ( &WorkerPool::run, this, i ) );
     }
-    if ( data.find ( "heal") != data.end () ) {
-        if ( ! data["heal"].is_null () ) 
-            if ( data["heal"].find ( "_id") != data["heal"].end () )
-                sprintf ( go.data.tower.heal, "%s", data["heal"]["_id"].get<std::string> ().c_str () );
+    ~WorkerPool ()
+    {
+        stop ();
     }
-    if ( data.find ( "repair") != data.end () ) {
-        if ( ! data["repair"].is_null () ) 
-            if ( data["repair"].find ( "_id") != data["repair"].end () )
-                sprintf ( go.data.tower.repair, "%s", data["repair"]["_id"].get<std::string> ().c_str () );
+    /* the running tasks are finished, the queued and later ones are dropped */
+    void stop ()
+    {
+        {
+            std::lock_guard<std::mutex> lock ( m_idleMutex );
+            m_stopped = true;
+        }
+        m_idle.notify_all ();
+        for ( auto& thread : m_threads ) if ( thread.joinable () ) thread.join ();
     }
-}
+    void submit ( std::function<void()> task )
+    {
+        Worker& worker = *m_workers[m_next ++ % m_workers.size ()];
+        {
+            std::lock_guard<std::mutex> lock ( worker.mutex );
+            worker.tasks.push_back ( std::move ( task ) );
+            m_pending ++;
+        }
+        /* a worker between its check and its wait cannot miss the notification */
+        { std::lock_guard<std::mutex> lock ( m_idleMutex ); }
+        m_idle.notify_one ();
+    }
+    size_t size () const
+    {
+        return m_workers.size ();
+    }
+protected:
+    typedef struct {
+        std::mutex mutex;
+        std::deque < std::function<void()> > tasks;
+    } Worker;
+
+    std::vector < std::unique_ptr < Worker > > m_workers;
+    std::vector < std::thread > m_threads;
+    std::mutex m_idleMutex;
+    std::condition_variable m_idle;
+    std::atomic<size_t> m_pending;      // tasks queued in the deques, changed under the deque lock
+    bool m_stopped;                     // guarded by m_idleMutex
+    std::atomic<size_t> m_next;
+
+    bool take ( size_t index, std::function<void()>& task )
+    {
+        for ( size_t i = 0 ; i < m_workers.size () ; i ++ )
+        {
+            Worker& worker = *m_workers[( index + i ) % m_workers.size ()];
+            std::lock_guard<std::mutex> lock ( worker.mutex );
+            if ( worker.tasks.empty () ) continue;
+            if ( i == 0 ) { task = std::move ( worker.tasks.front () ); worker.tasks.pop_front (); }
+            else { task = std::move ( worker.tasks.back () ); worker.tasks.pop_back (); }
+            m_pending --;
+            return true;
+        }
+        return false;
+    }
+    void run ( size_t index )
+    {
+        std::function<void()> task;
+        while ( true )
+        {
+            {
+                std::unique_lock<std::mutex> lock ( m_idleMutex );
+                m_idle.wait ( lock, [this] { return m_stopped || m_pending > 0; } );
+                if ( m_stopped ) return;
+            }
+            if ( ! take ( index, task ) ) continue;
+            task ();
+        }
+    }
+};
 
-void CreepFromJson ( GameObject& go, nlohmann::json data )
+std::unique_ptr < WorkerPool > decoders;
+
+/*
+ * per room ordering of the frames : the socket thread numbers them, the
+ * workers decode them in any order and the decoded frames are released to
+ * frameQueue strictly by number
+ */
+typedef struct {
+    bool first;                         // socket thread only
+    std::atomic<bool> resyncPending;
+    unsigned long long received;        // socket thread only
+    std::mutex mutex;
+    unsigned long long next;
+    bool resync;                        // a full frame could not be decoded, the next one released replaces it
+    std::map < unsigned long long, std::unique_ptr < RoomFrame > > decoded;   // discarded data for undecodable frames
+} RoomIngest;
+
+std::map < std::string, RoomIngest > ingest;    // filled before listening
+
+/* worker thread */
+void decodeFrame ( const std::string& room, unsigned long long sequence, bool full, const std::string& consoleData )
 {
-    go.staticObject = false;
-    if ( data.find ( "spawning") != data.end () ) go.data.creep.spawning = data["spawning"].get<bool> ();
+    std::unique_ptr < RoomFrame > frame ( new RoomFrame () );
+    frame->room = room;
+    frame->full = full;
+    try {
+        frame->data = nlohmann::json::parse ( consoleData );
+    }
+    catch ( std::exception& e )
+    {
+        std::cerr << "Error: cannot decode frame of " << room << ": " << e.what () << std::endl;
+        frame->data = nlohmann::json ( nlohmann::json::value_t::discarded );
+    }
+    RoomIngest& in = ingest.find ( room )->second;
+    std::lock_guard<std::mutex> lock ( in.mutex );
+    in.decoded[sequence] = std::move ( frame );
+    for ( auto it = in.decoded.begin () ; it != in.decoded.end () && it->first == in.next ; it = in.decoded.erase ( it ), in.next ++ )
+    {
+        RoomFrame& ready = *it->second;
+        if ( ready.data.is_discarded () )
+        {
+            /* the room must not keep applying diffs on top of a snapshot it never got */
+            if ( ready.full ) in.resync = true;
+            continue;
+        }
+        if ( in.resync ) ready.full = true;
+        in.resync = false;
+        frameQueue.push ( std::move ( ready ) );
+    }
 }
 
-void FromJson ( GameObject& go, nlohmann::json data )
+/* socket thread : number the frame and hand it to the decoders */
+void roomProcess(const std::string& room, std::string consoleData)
 {
-    go.staticObject = true;
-    if ( data.find ( "_id" ) != data.end () ) go.id = data["_id"].get<std::string>();
-    if ( data.find ( "user" ) != data.end () ) go.user = data["user"].get<std::string>();
-    if ( data.find ( "type" ) != data.end () ) go.type = data["type"].get<std::string>();
-    if ( data.find ( "x" ) != data.end () ) go.x = data["x"].get<int>();
-    if ( data.find ( "y" ) != data.end () ) go.y = data["y"].get<int>();
-    if ( data.find ( "hitsMax" ) != data.end () ) go.hitsMax = data["hitsMax"].get<int>();
-    if ( data.find ( "hits" ) != data.end () ) go.hits = data["hits"].get<int>();
-    if ( go.type == "controller" ) ControllerFromJson ( go, data );
-    if ( go.type == "source" ) SourceFromJson ( go, data );
-    if ( go.type == "mineral" ) MineralFromJson ( go, data );
-    if ( go.type == "spawn" ) SpawnFromJson ( go, data );
-    if ( go.type == "extension" ) ExtensionFromJson ( go, data );
-    if ( go.type == "road" ) RoadFromJson ( go, data );
-    if ( go.type == "container" ) ContainerFromJson ( go, data );
-    if ( go.type == "storage" ) StorageFromJson ( go, data );
-    if ( go.type == "creep" ) CreepFromJson ( go, data );
+    RoomIngest& in = ingest.find ( room )->second;
+    unsigned long long sequence = in.received ++;
+    bool full = in.first || in.resyncPending.exchange ( false );
+    in.first = false;
+    std::shared_ptr < std::string > data = std::make_shared < std::string > ( std::move ( consoleData ) );
+    decoders->submit ( [room, sequence, full, data] () { decodeFrame ( room, sequence, full, *data ); } );
 }
 
-std::map < std::string, GameObject > roomContent;
-
-nlohmann::json userData;
-nlohmann::json initialRoomData;
-nlohmann::json updatedRoomData;
-bool roomInitialized = false;
-bool updatePaused = false;
-
-void drawWindow ();
-
-std::map < std::string, bool > displayed;
-
-void initializeRoomContent (nlohmann::json roomData)
+/* apply thread : brings the rooms up to date with the queued frames */
+void applyLoop ()
 {
-    if ( roomData.is_null () ) throw Exception ( "null data received" );
-    std::cout << roomData.dump ( 4 ) << std::endl;
-    for ( nlohmann::json::iterator it = roomData["objects"].begin () ; it != roomData["objects"].end () ; ++ it )
+    RoomFrame frame;
+    while ( frameQueue.pop ( frame ) )
     {
-        GameObject go;
         try {
-            FromJson ( go, it.value () );
+            std::lock_guard<std::mutex> lock ( roomMutex );
+            RoomState& room = rooms.find ( frame.room )->second;
+            updatedRoomData = std::move ( frame.data );
+            if ( updatedRoomData.find ( "gameTime" ) != updatedRoomData.end () && updatedRoomData["gameTime"].is_number () )
+                room.gameTime = updatedRoomData["gameTime"].get<GameTime> ();
+            if ( ! room.initialized ) {
+                initializeRoomContent(room, updatedRoomData);
+                *logOutput << std::endl;
+                displayed.clear ();
+            }
+            else if ( frame.full ) {
+                resyncRoomContent(room, updatedRoomData);
+            }
+            else if ( ! updatePaused ) {
+                updateRoomContent(room, updatedRoomData);
+                expireRoomContent(room);
+            }
+            if ( ! room.changed.empty () )
+                refreshQueries ( frame.room, room, updatedRoomData.value ( "gameTime", nlohmann::json () ) );
         }
-        catch (...) { throw Exception ( "problem in room initial content" ); }
-        roomContent[go.id] = go;
-        /**/
-        if ( serverOptions["disableGUI"].get<bool> () ) if ( displayed.find ( go.type ) == displayed.end () )
+        catch ( std::exception& e )
         {
-            std::cout << "---------" << go.type << "---------" << std::endl << it.value().dump () << std::endl;
-            displayed[go.type] = true;
+            std::cerr << "Error: " << e.what () << std::endl;
         }
-        /**/
+        try {
+            /* viewers follow the server, even while the local display is paused */
+            if ( fanout ) fanout->publish ( frame.room, updatedRoomData, frame.full );
+            if ( exporter ) exporter->record ( frame.room, updatedRoomData );
+        }
+        catch ( std::exception& e )
+        {
+            std::cerr << "Error: " << e.what () << std::endl;
+        }
+        roomDirty = true;
     }
-    roomInitialized = true;
 }
 
-bool firstUpdate = true;
+typedef struct {
+    unsigned long long checks;          // room verifications run
+    unsigned long long drifted;         // objects resynced since start
+    unsigned long long lastDrifted;     // objects resynced by the last verification
+    unsigned long long unavailable;     // checks skipped, the fetch had no objects to compare
+} DriftStats;
 
-void updateRoomContent (nlohmann::json roomData)
+/*
+ * background check of the incremental state against a full fetch of the room
+ *
+ * the room hashes are compared first, on mismatch only the objects differing
+ * from the fetched snapshot are resynced. objects touched by a frame while
+ * the fetch was running are skipped : their local state is newer.
+ */
+class StateVerifier
 {
-    //if ( firstUpdate )
-    for ( nlohmann::json::iterator it = roomData["objects"].begin () ; it != roomData["objects"].end () ; ++ it )
+public:
+    typedef std::function < nlohmann::json ( const std::string& ) > Fetch;
+
+    StateVerifier ( Fetch fetch, int period ) : m_fetch ( fetch ), m_period ( period )
     {
-        std::string id = it.key (); // sprintf ( id, "%s", it.key ().c_str () );
-        GameObject go = roomContent[id];
+        m_stats = DriftStats ();
+    }
+    void start ()
+    {
+        std::thread ( &StateVerifier::run, this ).detach ();
+    }
+    DriftStats stats ()
+    {
+        std::lock_guard<std::mutex> lock ( m_mutex );
+        return m_stats;
+    }
+protected:
+    Fetch m_fetch;
+    int m_period;                       // seconds
+    std::mutex m_mutex;
+    DriftStats m_stats;
+
+    void run ()
+    {
+        while ( true )
+        {
+            std::this_thread::sleep_for ( std::chrono::seconds ( m_period ) );
+            for ( auto& room : observedRooms )
+            {
+                try {
+                    verify ( room );
+                }
+                catch ( std::exception& e )
+                {
+                    std::cerr << "Error: verification of " << room << " failed: " << e.what () << std::endl;
+                }
+            }
+        }
+    }
+    void verify ( const std::string& name )
+    {
+        /* a paused display drifts on purpose */
+        if ( updatePaused ) return;
+        RoomState& room = rooms.find ( name )->second;
+        {
+            std::lock_guard<std::mutex> lock ( roomMutex );
+            if ( ! room.initialized ) return;
+            room.touched.clear ();
+            room.tracking = true;
+        }
+        nlohmann::json snapshot;
+        ObjectMap server;
+        std::map < std::string, nlohmann::json > serverData;
+        unsigned long long hash = 0;
+        bool usable = false;
         try {
-            if ( it.value().find ( "x" ) != it.value().end () ) go.x = it.value()["x"].get<int> ();
-            if ( it.value().find ( "y" ) != it.value().end () ) go.y = it.value()["y"].get<int> ();
+            snapshot = m_fetch ( name );
+            nlohmann::json::iterator objects = snapshot.find ( "objects" );
+            usable = objects != snapshot.end () && ( objects->is_array () || objects->is_object () );
+            if ( usable ) for ( nlohmann::json::iterator it = objects->begin () ; it != objects->end () ; ++ it )
+            {
+                if ( ! it.value ().is_object () ) continue;
+                GameObject go = GameObject ();
+                FromJson ( go, it.value () );
+                if ( go.id == "" && objects->is_object () ) go.id = it.key ();
+                go.hash = hashGameObject ( go );
+                hash += go.hash;
+                server[go.id] = go;
+                serverData[go.id] = it.value ();
+            }
         }
-        catch (...) { throw Exception ( "problem in room updated content" ); }
-        roomContent[id] = go;
-        /**/
-        if ( serverOptions["disableGUI"].get<bool> () ) if ( displayed.find ( go.type ) == displayed.end () )
+        catch ( ... )
         {
-            std::cout << "---------" << go.type << "---------" << std::endl << it.value().dump () << std::endl;
-            displayed[go.type] = true;
+            /* a snapshot that cannot be read entirely is not compared at all */
+            std::lock_guard<std::mutex> lock ( roomMutex );
+            room.tracking = false;
+            room.touched.clear ();
+            throw;
         }
-        /**/
+        nlohmann::json correction = { { "objects", nlohmann::json::object () } };
+        {
+            std::lock_guard<std::mutex> lock ( roomMutex );
+            room.tracking = false;
+            if ( usable && hash != room.hash )
+            {
+                for ( auto& remote : server )
+                {
+                    if ( room.touched.count ( remote.first ) ) continue;
+                    ObjectMap::iterator local = room.content.find ( remote.first );
+                    if ( local != room.content.end () && local->second.hash == remote.second.hash ) continue;
+                    storeObject ( room, remote.second );
+                    correction["objects"][remote.first] = serverData[remote.first];
+                }
+                std::vector < std::string > gone;
+                for ( auto& local : room.content )
+                    if ( server.find ( local.first ) == server.end () && ! room.touched.count ( local.first ) )
+                        gone.push_back ( local.first );
+                for ( auto& id : gone )
+                {
+                    eraseObject ( room, room.content.find ( id ) );
+                    correction["objects"][id] = nullptr;
+                }
+                if ( ! room.changed.empty () ) refreshQueries ( name, room, nlohmann::json () );
+            }
+            room.touched.clear ();
+        }
+        if ( ! usable )
+        {
+            /* nothing was compared : not a check */
+            unavailable ();
+            std::cerr << "Error: verification of " << name << " skipped, the fetched room has no objects" << std::endl;
+            return;
+        }
+        size_t drifted = correction["objects"].size ();
+        record ( drifted );
+        if ( drifted == 0 ) return;
+        /* viewers & export get the correction as a regular diff */
+        if ( fanout ) fanout->publish ( name, correction, false );
+        if ( exporter ) exporter->record ( name, correction );
+        roomDirty = true;
+        if ( serverOptions["disableGUI"].get<bool> () )
+            *logOutput << "drift: " << drifted << " objects of " << name << " resynced" << std::endl;
     }
-}
-
-void roomProcess(std::string consoleData)
-{
-    static bool first = true;
-    updatedRoomData = nlohmann::json::parse ( consoleData );
-    if ( first ) {
-        initializeRoomContent(updatedRoomData);
-        first = false;
-        std::cout << std::endl;
-        displayed.clear ();
+    void unavailable ()
+    {
+        std::lock_guard<std::mutex> lock ( m_mutex );
+        m_stats.unavailable ++;
     }
-    else if ( ! updatePaused ) {
-        updateRoomContent(updatedRoomData);
+    void record ( size_t drifted )
+    {
+        std::lock_guard<std::mutex> lock ( m_mutex );
+        m_stats.checks ++;
+        m_stats.drifted += drifted;
+        m_stats.lastDrifted = drifted;
     }
-    if ( ! serverOptions["disableGUI"].get<bool> () )
-        drawWindow ();
-}
+};
+
+std::shared_ptr < StateVerifier > verifier;
 
 /*
     Ncurses UI
@@ -544,6 +2018,7 @@ int mouse_x, mouse_y;
 std::string terrain = "";
 
 std::vector < GameObject > underMouse;
+size_t shownRoom = 0;
 
 void initScreen ()
 {
@@ -557,6 +2032,7 @@ void initScreen ()
     start_color();
     use_default_colors();
     mousemask(ALL_MOUSE_EVENTS, NULL);
+    timeout ( 50 );     // getch returns regularly so applied frames get drawn
 
     int i,j;
     int ccount = 9;
@@ -618,7 +2094,8 @@ void getColor(char mcase, int& fg, int& bg, int x, int y)
 
 void drawWindow ()
 {
-    std::string terrain = initialRoomData["terrain"].get<std::string> ();
+    RoomState& room = rooms.find ( observedRooms[shownRoom] )->second;
+    std::string terrain = room.initialData["terrain"].get<std::string> ();
     int y = 0;
     std::string::iterator it = terrain.begin ();
     while ( it != terrain.end () )
@@ -641,7 +2118,9 @@ void drawWindow ()
         it += 50;
         y ++;
     }
-    std::map < std::string, GameObject >::const_iterator obj;
+    std::unique_lock<std::mutex> lock ( roomMutex );
+    ObjectMap& roomContent = room.content;
+    ObjectMap::const_iterator obj;
     for ( obj = roomContent.begin () ; obj != roomContent.end () ; ++ obj )
     {
         int x = obj->second.x, y = obj->second.y;
@@ -694,6 +2173,7 @@ void drawWindow ()
             print ( 2*x+1, y+1, out );
             attroff ( COLOR_PAIR ( 1 + fg * 9 + bg ) );
     }
+    lock.unlock ();
     /**/
     std::ostringstream stream;
     stream << "Mouse: " << mouse_x << "," << mouse_y;
@@ -701,6 +2181,39 @@ void drawWindow ()
     print ( 102, 1, message );
     std::wstring tmp = L"\u2673";
     print ( 102, 2, tmp );
+    std::string shown = observedRooms[shownRoom] + ( observedRooms.size () > 1 ? "  (n: next room)   " : "   " );
+    print ( 104, 2, shown );
+    if ( websocket )
+    {
+        SocketStats stats = websocket->stats ();
+        std::ostringstream link;
+        link << ( stats.connected ? "Online " : "Offline" ) << "  reconnects: " << stats.reconnects
+             << "  downtime: " << (int) stats.downtime << "s   ";
+        print ( 102, 3, link.str () );
+    }
+    FrameQueueStats frames = frameQueue.stats ();
+    std::ostringstream queue;
+    queue << "Frames: " << frames.applied << " applied  " << frames.merged << " merged  "
+          << frames.dropped << " dropped  queue: " << frames.depth << "/" << frames.maxDepth << "   ";
+    print ( 102, 4, queue.str () );
+    PoolStats pool = PoolAllocator < ObjectEntry >::stats ();
+    std::ostringstream objects;
+    objects << "Objects: " << liveObjects << " live  " << pool.freed << " freed  " << objectsRemoved << " removed  " << objectsExpired << " expired   ";
+    print ( 102, 7, objects.str () );
+    if ( verifier )
+    {
+        DriftStats drift = verifier->stats ();
+        std::ostringstream check;
+        check << "Drift: " << drift.drifted << " objects resynced in " << drift.checks << " checks (last " << drift.lastDrifted << ", "
+              << drift.unavailable << " skipped)   ";
+        print ( 102, 6, check.str () );
+    }
+    if ( fanout )
+    {
+        std::ostringstream viewers;
+        viewers << "Viewers: " << fanout->subscribers () << "   ";
+        print ( 102, 5, viewers.str () );
+    }
     /*
     int yy = 4;
     for ( obj = roomContent.begin () ; obj != roomContent.end () ; ++ obj )
@@ -737,15 +2250,36 @@ void selectUnderMouseObjects ( int x, int y )
 /*
 */
 
+void stopListening ()
+{
+    for ( auto& room : observedRooms ) client->RoomListener ( room );
+}
+
+std::thread applyThread;
+
+/* no frame is accepted anymore, the queued ones are applied before the export is flushed */
+void stopObserving ()
+{
+    if ( client ) stopListening ();
+    frameQueue.stop ();
+    if ( applyThread.joinable () ) applyThread.join ();
+    if ( decoders ) decoders->stop ();
+    if ( fanout ) fanout->stop ();
+    if ( exporter ) exporter->flush ();
+}
+
+bool roomsInitialized ()
+{
+    for ( auto& room : rooms ) if ( ! room.second.initialized ) return false;
+    return true;
+}
+
+std::atomic<bool> interrupted ( false );
+
+/* may run on any thread : only ask the main thread to shut down */
 void my_handler(int s){
-    if ( ! serverOptions["disableGUI"].get<bool> () )
-    {
-        resetWindow ();
-        resetScreen ();
-    }
     //std::cout << "caught signal" << std::endl;
-    client->RoomListener ( serverOptions["room"].get<std::string>() );
-    exit(1); 
+    interrupted = true;
 }
 
 int main ( int argc, char** argv )
@@ -761,12 +2295,34 @@ int main ( int argc, char** argv )
         ServerOptions server;
         serverOptions = server.parseArgs ( index, argc, argv );
 
+        std::istringstream roomList ( serverOptions["room"].get<std::string>() );
+        std::string roomName;
+        while ( std::getline ( roomList, roomName, ',' ) )
+        {
+            if ( roomName == "" || rooms.find ( roomName ) != rooms.end () ) continue;
+            observedRooms.push_back ( roomName );
+            rooms[roomName];
+            ingest[roomName].first = true;
+        }
+        if ( observedRooms.empty () ) error ( "no room to observe" );
+        expireTicks = std::stoi ( serverOptions["expireTicks"].get<std::string>() );
+        int workers = std::stoi ( serverOptions["workers"].get<std::string>() );
+        decoders.reset ( new WorkerPool ( workers > 0 ? workers : std::thread::hardware_concurrency () ) );
+
         std::shared_ptr < ScreepsApi::Web::Client > web (
             new WebClient ( serverOptions["serverIP"].get<std::string>()+":"+serverOptions["serverPort"].get<std::string>() )
         );
-        std::shared_ptr < ScreepsApi::Web::Socket > socket (
-            new WebsocketClient ( serverOptions["serverIP"].get<std::string>()+":"+serverOptions["serverPort"].get<std::string>()+"/socket/websocket" )
-        );
+        websocket = std::make_shared < WebsocketClient > ( serverOptions["serverIP"].get<std::string>()+":"+serverOptions["serverPort"].get<std::string>()+"/socket/websocket" );
+        websocket->onReconnect ( [] () {
+            for ( auto& room : ingest ) room.second.resyncPending = true;
+            if ( serverOptions["disableGUI"].get<bool> () )
+            {
+                SocketStats stats = websocket->stats ();
+                *logOutput << "reconnected to server (" << stats.reconnects << " reconnects, "
+                          << stats.downtime << "s total downtime)" << std::endl;
+            }
+        } );
+        std::shared_ptr < ScreepsApi::Web::Socket > socket = websocket;
         ScreepsApi::ApiManager::Instance ().initialize ( web, socket );
         client = ScreepsApi::ApiManager::Instance ().getApi ();
         bool ok = client->Signin ( serverOptions["username"], serverOptions["password"] );
@@ -774,7 +2330,7 @@ int main ( int argc, char** argv )
             std::cerr << "Error: cannot connect/signin to the server" << std::endl;
             exit ( -1 );
         }
-        while ( ! client->initialized () ) std::this_thread::sleep_for ( std::chrono::milliseconds ( 5 ) );
+        while ( ! client->initialized () && ! interrupted ) std::this_thread::sleep_for ( std::chrono::milliseconds ( 5 ) );
     }
     catch ( ... )
     {
@@ -783,27 +2339,59 @@ int main ( int argc, char** argv )
 
     try {
         userData = client->User ();
-        std::cout << userData.dump () << std::endl;
-        initialRoomData = client->Room (serverOptions["room"].get<std::string>());
-        client->RoomListener ( serverOptions["room"].get<std::string>(), roomProcess );
-        while ( ! roomInitialized ) std::this_thread::sleep_for ( std::chrono::milliseconds ( 5 ) );
+        if ( serverOptions["disableGUI"].get<bool> () )
+        {
+            std::istringstream queryList ( serverOptions["queries"].get<std::string>() );
+            std::string query;
+            while ( std::getline ( queryList, query, ';' ) )
+            {
+                if ( query.find_first_not_of ( " \t" ) == std::string::npos ) continue;
+                try {
+                    queries.push_back ( ObjectQuery ( query, userData["_id"].get<std::string> () ) );
+                }
+                catch ( Exception& e ) { error ( e.what () ); }
+            }
+            /* stdout is left to the query events, one json object per line */
+            if ( ! queries.empty () ) logOutput = &std::cerr;
+        }
+        *logOutput << userData.dump () << std::endl;
+        for ( auto& room : observedRooms )
+            rooms.find ( room )->second.initialData = client->Room ( room );
+        int servePort = std::stoi ( serverOptions["servePort"].get<std::string>() );
+        if ( servePort > 0 )
+        {
+            fanout = std::make_shared < FanoutServer > ( servePort, serverOptions["serveAddress"].get<std::string>() );
+            for ( auto& room : observedRooms ) fanout->observe ( room );
+            fanout->start ();
+        }
+        if ( serverOptions["exportFile"].get<std::string>() != "" )
+            exporter = std::make_shared < ColumnarExporter > ( serverOptions["exportFile"].get<std::string>(), 1000 );
+        applyThread = std::thread ( applyLoop );
+        int verifyPeriod = std::stoi ( serverOptions["verifyPeriod"].get<std::string>() );
+        if ( verifyPeriod > 0 )
+        {
+            verifier = std::make_shared < StateVerifier > ( [] ( const std::string& room ) { return client->Room ( room ); }, verifyPeriod );
+            verifier->start ();
+        }
+        for ( auto& room : observedRooms )
+            client->RoomListener ( room, std::bind ( roomProcess, room, std::placeholders::_1 ) );
+        while ( ! roomsInitialized () && ! interrupted ) std::this_thread::sleep_for ( std::chrono::milliseconds ( 5 ) );
     }
     catch ( ... )
     {
-        client->RoomListener ( serverOptions["room"].get<std::string>() );
+        stopObserving ();
         exit ( -1 );
     }
 
     try {
-        if ( ! serverOptions["disableGUI"].get<bool> () )
+        if ( ! serverOptions["disableGUI"].get<bool> () && ! interrupted )
         {
             x = y = 0; w = WIDTH; h = HEIGHT;
             initScreen ();
             initWindow ();
-            while ( true )
+            drawWindow ();
+            while ( ! interrupted )
             {
-                drawWindow ();
-                std::this_thread::sleep_for ( std::chrono::milliseconds ( 5 ) );
                 MEVENT event;
                 int key = getch ();
                 if ( key == KEY_MOUSE && getmouse(&event) == OK )
@@ -812,20 +2400,31 @@ int main ( int argc, char** argv )
                 }
                 if ( key == 'q' ) break;
                 if ( key == 'p' ) updatePaused = ! updatePaused;
+                if ( key == 'n' ) { shownRoom = ( shownRoom + 1 ) % observedRooms.size (); roomDirty = true; }
+                if ( roomDirty.exchange ( false ) || key != ERR ) drawWindow ();
             }
             resetWindow ();
             resetScreen ();
         }
-        else while ( true )
+        else while ( ! interrupted )
             std::this_thread::sleep_for ( std::chrono::milliseconds ( 5 ) );
     }
     catch ( ... )
     {
         resetWindow ();
         resetScreen ();
-        client->RoomListener ( serverOptions["room"].get<std::string>() );
+        stopObserving ();
         exit ( -1 );
     }
-    client->RoomListener ( serverOptions["room"].get<std::string>() );
-    return 0;
+    stopObserving ();
+    if ( serverOptions["disableGUI"].get<bool> () )
+    {
+        FrameQueueStats frames = frameQueue.stats ();
+        *logOutput << "frames: " << frames.received << " received, " << frames.applied << " applied, "
+                  << frames.merged << " merged, " << frames.dropped << " dropped, max queue " << frames.maxDepth << std::endl;
+        PoolStats pool = PoolAllocator < ObjectEntry >::stats ();
+        *logOutput << "objects: " << liveObjects << " live, " << pool.freed << " freed, "
+                  << objectsRemoved << " removed, " << objectsExpired << " expired" << std::endl;
+    }
+    return interrupted ? 1 : 0;
 }